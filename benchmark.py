@@ -0,0 +1,424 @@
+#! /usr/bin/python
+# (C) 2012 Biorobotics Lab and Nonolith Labs
+# Licensed under the terms of the GNU GPLv3+
+
+# Latency and throughput benchmark for the whole acquisition chain:
+# firmware frame acquisition, wire bytes, host decode / compensation and
+# conversion-start to frame-on-host latency. Run with --simulate to use a
+# simulated device and a synthetic firmware timing model, no hardware needed.
+# The model's assumed constants are written to the "model" section of the
+# results; simulated latency tails come mostly from those assumptions, and a
+# firmware change only shows up there once the model is updated to match.
+
+import sys
+import time
+import json
+import math
+import types
+import random
+import argparse
+import platform
+import contextlib
+import collections
+from array import array
+
+# firmware constants, see firmware/main.c and firmware/TakkTile.h
+F_TWI = 1000000                 # I2C bit rate
+TCC0_TICK_US = 256 / 32.0       # TCC0 runs from F_CPU / 256
+SENSORS_COLUMN = 6              # slots scanned per row by getSensorData()
+ROWS = 8
+USART_FRAME_BYTES = 160         # DMA.CH0.TRFCNT
+USB_PACKET = 64                 # ep_in max packet size
+USB_FS_BIT_US = 1 / 12.0        # full speed bit time
+# assumption: token + data SYNC/PID/CRC + handshake bytes, bit stuffing ignored
+USB_PACKET_OVERHEAD = 10
+# assumption: the host sees a completion anywhere within one full speed frame
+USB_FRAME_US = 1000.0
+MPL115A2_TC_US = 1600.0         # maximum conversion time from the datasheet
+# assumption: a bulk read returning faster than this found its frame already queued
+STALE_READ_US = 100.0
+# assumption: spread of the lognormal OS scheduling delay, median set by --host-jitter
+HOST_JITTER_SIGMA = 0.5
+
+# host side layout, TakkTile.getAlive() decodes five cells per bitmap byte
+HOST_COLUMNS = 5
+MAX_CELLS = ROWS * HOST_COLUMNS
+
+# factory coefficients from the AN3785 example: a0, b1, b2, c12
+SIM_CALIBRATION = [0x3E, 0xCE, 0xB3, 0xF9, 0xC5, 0x17, 0x33, 0xC8]
+
+
+def _bits(n):
+    # one I2C byte with ACK, in microseconds
+    return n * 9 * 1e6 / F_TWI
+
+_cond = 1e6 / F_TWI             # START or STOP condition
+_bother = _cond + _bits(1)      # botherAddress(address, 0)
+
+# per alive cell: enable, write 0x00 to 0xC0, read four bytes from 0xC1, disable
+CELL_READ_US = (_bother + _cond) + _bother + (_bits(1) + _cond) + (_bother + _bits(4) + _cond) + (_bother + _cond)
+# assumption, not measured: per alive cell, polling loops and send_byte()
+# between I2C transactions
+CELL_CPU_US = 5.0
+# assumption, not measured: per scanned slot, bitmap test and the STOP
+# issued for dead slots
+SLOT_CPU_US = 0.5
+# startConversion(): all-call enable, write 0x01 to 0x12, all-call disable
+CONVERSION_WRITE_US = (_bother + _cond) + _bother + _bits(2) + _cond
+CONVERSION_TAIL_US = _bother + _cond
+
+
+def timingModel(hostJitterUs = None):
+    """The constants behind the modelled numbers, recorded with the results."""
+    model = {"i2c_bit_rate": F_TWI, "cell_read_us": CELL_READ_US, "cell_cpu_us": CELL_CPU_US,
+             "slot_cpu_us": SLOT_CPU_US, "conversion_write_us": CONVERSION_WRITE_US,
+             "conversion_tail_us": CONVERSION_TAIL_US, "usb_packet_overhead": USB_PACKET_OVERHEAD,
+             "usb_frame_us": USB_FRAME_US, "stale_read_us": STALE_READ_US}
+    if hostJitterUs is not None:
+        model["host_jitter_median_us"] = hostJitterUs
+        model["host_jitter_sigma"] = HOST_JITTER_SIGMA
+    return model
+
+
+def percentiles(samples):
+    """Return min/mean/p50/p99/p999/max of a list of samples, nearest rank.
+
+    p99 and p999 are left out when there are too few samples to tell them from max."""
+    if not samples:
+        return {}
+    s = sorted(samples)
+    rank = lambda p: s[min(len(s) - 1, max(0, int(math.ceil(p * len(s))) - 1))]
+    result = {"n": len(s), "min": s[0], "mean": sum(s) / len(s), "p50": rank(0.50), "max": s[-1]}
+    if len(s) >= 100:
+        result["p99"] = rank(0.99)
+    if len(s) >= 1000:
+        result["p999"] = rank(0.999)
+    return result
+
+
+def wireBytes(cells):
+    """Bytes per frame on the USB bus and the USART for a given number of alive cells."""
+    payload = 4 * cells
+    # break_and_flush() ends the transfer with a short packet, zero length if needed
+    packets = payload // USB_PACKET + 1
+    return {"cells": cells, "payload": payload, "usb_packets": packets,
+            "usb_bus": payload + packets * USB_PACKET_OVERHEAD, "usart": USART_FRAME_BYTES}
+
+
+def firmwareFrameUs(cells):
+    """Modelled time spent in getSensorData() for a given number of alive cells."""
+    return cells * (CELL_READ_US + CELL_CPU_US) + ROWS * SENSORS_COLUMN * SLOT_CPU_US
+
+
+class SimulatedDevice:
+    """Stands in for the pyusb device, answering the vendor requests used by TakkTile."""
+
+    def __init__(self, cells, seed = 0, pool = 256):
+        self.bitmap = [0] * 8
+        for index in range(cells):
+            self.bitmap[index // HOST_COLUMNS] |= 1 << (index % HOST_COLUMNS)
+        rng = random.Random(seed)
+        # pre-built frames so that read() costs no more than a real transfer copy
+        self.frames = []
+        for i in range(pool):
+            frame = array('B')
+            for cell in range(cells):
+                # ten bit samples, MSB first, left aligned in two bytes
+                Padc = rng.randint(300, 700)
+                Tadc = rng.randint(450, 550)
+                frame.extend([Padc >> 2, (Padc & 3) << 6, Tadc >> 2, (Tadc & 3) << 6])
+            self.frames.append(frame)
+        self.frameCt = 0
+
+    def ctrl_transfer(self, bmRequestType, bRequest, wValue = 0, wIndex = 0, length = 0):
+        if bRequest == 0x5C:
+            return array('B', self.bitmap)
+        if bRequest == 0x6C:
+            alive = self.bitmap[wIndex] & (1 << wValue)
+            return array('B', SIM_CALIBRATION if alive else [0] * 8)
+        if bRequest == 0xC7:
+            return array('B', [1 if wIndex != 0 else 0])
+        return array('B', [1])
+
+    def read(self, endpoint, size, timeout = None):
+        frame = self.frames[self.frameCt % len(self.frames)]
+        self.frameCt += 1
+        return frame
+
+
+class ReplayDevice:
+    """Replays captured bulk reads, so decode paths can be timed without the USB wait."""
+
+    def __init__(self, frames):
+        self.frames = frames
+        self.frameCt = 0
+
+    read = SimulatedDevice.read
+
+
+class TimedDevice:
+    """Wraps a pyusb device, recording the blocking time and size of each bulk read."""
+
+    def __init__(self, dev, keep = 256):
+        self.dev = dev
+        self.readUs = []
+        self.readBytes = []
+        self.readEnd = None
+        # the last few frames read, for replay
+        self.frames = collections.deque(maxlen = keep)
+
+    def __getattr__(self, name):
+        return getattr(self.dev, name)
+
+    def read(self, *args):
+        start = time.perf_counter()
+        data = self.dev.read(*args)
+        self.readEnd = time.perf_counter()
+        self.readUs.append((self.readEnd - start) * 1e6)
+        self.readBytes.append(len(data))
+        self.frames.append(data)
+        return data
+
+
+def simulatedTakkTile(cells, seed):
+    """Build a TakkTile instance on top of a SimulatedDevice, bypassing USB enumeration."""
+    # TakkTile.py only touches pyusb in __init__, which is skipped here
+    if "usb" not in sys.modules:
+        try:
+            import usb
+        except ImportError:
+            sys.modules["usb"] = types.ModuleType("usb")
+    from TakkTile import TakkTile
+    tact = TakkTile.__new__(TakkTile)
+    tact.dev = SimulatedDevice(cells, seed)
+    tact.devs = [tact.dev]
+    tact.UIDs = ["simulated"]
+    tact.arrayID = 0
+    tact.alive = tact.getAlive()
+    tact.calibrationCoefficients = dict(list(map(tact.getCalibrationCoefficients, tact.alive)))
+    return tact
+
+
+# host decode paths to benchmark, add faster paths here to compare them
+DECODE_PATHS = {
+    "getDataRaw": lambda tact: tact.getDataRaw(),
+    "getData": lambda tact: tact.getData(),
+}
+
+
+def decodeThroughput(tact, frames):
+    """Time each decode path over a number of frames."""
+    results = {}
+    for name, path in DECODE_PATHS.items():
+        # warm up
+        for i in range(min(frames, 100)):
+            path(tact)
+        start = time.perf_counter()
+        for i in range(frames):
+            path(tact)
+        elapsed = time.perf_counter() - start
+        cells = max(len(tact.alive), 1)
+        results[name] = {"frames_per_s": frames / elapsed, "us_per_frame": elapsed / frames * 1e6,
+                         "ns_per_cell": elapsed / frames / cells * 1e9}
+    return results
+
+
+def convToReadUs(period):
+    """Modelled time from the 0x12 conversion write to the start of the next readout."""
+    # TCC0_CCA_vect: the timer is reset after startConversion() and trips at CCA
+    return CONVERSION_TAIL_US + period * TCC0_TICK_US
+
+
+def firmwareLatencyUs(cells, period):
+    """Modelled time from conversion start until the last packet of the frame is on the bus."""
+    lastPacket = wireBytes(cells)["payload"] % USB_PACKET + USB_PACKET_OVERHEAD
+    return convToReadUs(period) + firmwareFrameUs(cells) + lastPacket * 8 * USB_FS_BIT_US
+
+
+def simulateLatency(tact, frames, period, hostJitterUs, seed):
+    """End-to-end latency from conversion start to a compensated frame on the host.
+
+    The firmware and USB part comes from the timing model, host completion is
+    drawn from a seeded distribution, and the getData() call is measured."""
+    rng = random.Random(seed)
+    cells = len(tact.alive)
+    firmwareUs = firmwareLatencyUs(cells, period)
+    latency, decode = [], []
+    for i in range(frames):
+        start = time.perf_counter()
+        tact.getData()
+        decodeUs = (time.perf_counter() - start) * 1e6
+        # completion is seen on a frame boundary, then scheduled by the OS
+        hostUs = rng.uniform(0, USB_FRAME_US) + rng.lognormvariate(math.log(hostJitterUs), HOST_JITTER_SIGMA)
+        latency.append(firmwareUs + hostUs + decodeUs)
+        decode.append(decodeUs)
+    return {"latency_us": percentiles(latency), "decode_us": percentiles(decode),
+            "conversion_margin_us": convToReadUs(period) - MPL115A2_TC_US,
+            "frame_period_us": CONVERSION_WRITE_US + convToReadUs(period) + firmwareFrameUs(cells)}
+
+
+def runSimulated(args):
+    results = {"mode": "simulated", "period": args.period, "model": timingModel(args.host_jitter),
+               "firmware": [], "wire": [], "decode": {}, "latency": {}}
+    for cells in args.alive:
+        results["firmware"].append({"cells": cells, "acquisition_us": firmwareFrameUs(cells),
+                                    "conversion_start_us": CONVERSION_WRITE_US + CONVERSION_TAIL_US})
+        results["wire"].append(wireBytes(cells))
+        tact = simulatedTakkTile(cells, args.seed)
+        results["decode"][str(cells)] = decodeThroughput(tact, args.frames)
+        results["latency"][str(cells)] = simulateLatency(tact, args.frames, args.period,
+                                                         args.host_jitter, args.seed)
+    return results
+
+
+def runHardware(args):
+    from TakkTile import TakkTile
+    # keep the constructor's chatter out of the JSON on stdout
+    with contextlib.redirect_stdout(sys.stderr):
+        tact = TakkTile(args.array)
+    tact.dev = TimedDevice(tact.dev)
+    cells = len(tact.alive)
+    results = {"mode": "hardware", "UID": tact.UIDs[args.array], "period": args.period,
+               "model": timingModel(), "wire": [wireBytes(cells)]}
+    interval, latency, decode = [], [], []
+    stale = 0
+    tact.dev.ctrl_transfer(0x40|0x80, 0xC7, args.period, 0xFF, 1)
+    try:
+        last = None
+        for i in range(args.frames):
+            start = time.perf_counter()
+            tact.getData()
+            now = time.perf_counter()
+            readUs = tact.dev.readUs[-1]
+            # getData() time less the blocking bulk read is the host decode
+            decodeUs = (now - start) * 1e6 - readUs
+            decode.append(decodeUs)
+            # the conversion start is not visible to the host, but the firmware
+            # only starts it after flushing the previous frame: latency is the gap
+            # from the previous return to this read's return, less the conversion
+            # write. A read that did not block returned a frame queued earlier, of
+            # unknown age.
+            if readUs < STALE_READ_US:
+                stale += 1
+            elif last is not None:
+                latency.append((tact.dev.readEnd - last) * 1e6 - CONVERSION_WRITE_US + decodeUs)
+            if last is not None:
+                interval.append((now - last) * 1e6)
+            last = now
+    finally:
+        tact.stopSampling()
+    interval = percentiles(interval)
+    results["wire"][0]["measured_payload"] = percentiles(tact.dev.readBytes)
+    results["read_us"] = percentiles(tact.dev.readUs)
+    results["stale_reads"] = stale
+    results["stale"] = stale > 0
+    if stale:
+        print("warning: %d of %d reads returned without blocking, host fell behind" % (stale, args.frames),
+              file=sys.stderr)
+    results["latency"] = {str(cells): {"latency_us": percentiles(latency), "frame_interval_us": interval,
+                                       "decode_us": percentiles(decode)}}
+    # time the decode paths on the captured frames, as in simulated mode
+    timed = tact.dev
+    tact.dev = ReplayDevice(list(timed.frames))
+    results["decode"] = {str(cells): decodeThroughput(tact, args.frames)}
+    tact.dev = timed
+    # firmware acquisition estimate: frame interval less the timer wait and conversion
+    # start. With stale reads the interval is set by the host, so there is none.
+    estimate = None
+    if not stale:
+        estimate = interval["p50"] - args.period * TCC0_TICK_US - CONVERSION_WRITE_US - CONVERSION_TAIL_US
+    results["firmware"] = [{"cells": cells, "acquisition_estimate_us": estimate}]
+    return results
+
+
+def _flatten(d, prefix = ""):
+    # flatten nested results to {"a.b.c": number} for baseline comparison
+    out = {}
+    if isinstance(d, list):
+        d = dict((str(x.get("cells", i)), x) for i, x in enumerate(d))
+    for key, value in d.items():
+        name = prefix + str(key)
+        if isinstance(value, (dict, list)):
+            out.update(_flatten(value, name + "."))
+        elif isinstance(value, (int, float)) and not isinstance(value, bool):
+            out[name] = value
+    return out
+
+
+def compare(results, baseline):
+    """Print each metric shared with the baseline and its relative change."""
+    # metrics of runs in a different mode or at a different period mean different things
+    for key in ("mode", "period"):
+        if results.get(key) != baseline.get(key):
+            print("not comparing: %s is %r, baseline %r" % (key, results.get(key), baseline.get(key)),
+                  file=sys.stderr)
+            return False
+    # so do modelled numbers recorded under different assumptions
+    model, oldModel = results.get("model", {}), baseline.get("model", {})
+    for key in sorted(set(model) | set(oldModel)):
+        if model.get(key) != oldModel.get(key):
+            print("not comparing: model %s is %r, baseline %r" % (key, model.get(key), oldModel.get(key)),
+                  file=sys.stderr)
+            return False
+    if results.get("frames") != baseline.get("frames"):
+        print("warning: frames is %r, baseline %r" % (results.get("frames"), baseline.get("frames")),
+              file=sys.stderr)
+    # the model constants are the same on both sides, leave them out of the table
+    new, old = _flatten(dict(results, model = {})), _flatten(dict(baseline, model = {}))
+    print("%-48s %14s %14s %9s" % ("metric", "baseline", "new", "change"), file=sys.stderr)
+    for key in sorted(set(new) & set(old)):
+        if old[key]:
+            delta = "%+8.1f%%" % ((new[key] - old[key]) / old[key] * 100)
+        else:
+            # no relative change from zero, e.g. stale_reads
+            delta = "%9s" % ("+0.0%" if new[key] == 0 else "n/a")
+        print("%-48s %14.3f %14.3f %s" % (key, old[key], new[key], delta), file=sys.stderr)
+    return True
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="TakkTile acquisition chain benchmark")
+    parser.add_argument("--simulate", action="store_true", help="use a simulated device and timing model")
+    parser.add_argument("--frames", type=int, default=10000, help="frames per measurement, at least 2; "
+                        "p99 needs 100 and p999 1000 samples")
+    parser.add_argument("--alive", help="alive-set sizes from 0 to %d to sweep, only with --simulate "
+                        "(default 1,5,10,20,40)" % MAX_CELLS)
+    parser.add_argument("--period", type=int, default=100, help="TCC0.CCA sample period, as startSampling()")
+    parser.add_argument("--host-jitter", type=float, default=50.0, help="median simulated host scheduling delay in us")
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--array", type=int, default=0, help="arrayID of the hardware device")
+    parser.add_argument("--output", help="write JSON results here instead of stdout")
+    parser.add_argument("--baseline", help="JSON results of an earlier run to compare against")
+    args = parser.parse_args()
+    if args.frames < 2:
+        parser.error("--frames must be at least 2")
+    if not 1 <= args.period <= 0xFFFF:
+        parser.error("--period must be between 1 and 65535")
+    if args.host_jitter <= 0:
+        parser.error("--host-jitter must be positive")
+    if args.alive is not None and not args.simulate:
+        parser.error("--alive only applies with --simulate")
+    try:
+        args.alive = [int(x) for x in (args.alive or "1,5,10,20,40").split(",")]
+    except ValueError:
+        parser.error("--alive must be a comma separated list of integers")
+    if not all(0 <= x <= MAX_CELLS for x in args.alive):
+        parser.error("--alive sizes must be between 0 and %d" % MAX_CELLS)
+    if len(set(args.alive)) != len(args.alive):
+        parser.error("--alive sizes must not repeat")
+
+    results = runSimulated(args) if args.simulate else runHardware(args)
+    results["frames"] = args.frames
+    results["python"] = platform.python_version()
+    results["timestamp"] = time.strftime("%Y-%m-%dT%H:%M:%S")
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(results, f, indent=1, sort_keys=True)
+    else:
+        json.dump(results, sys.stdout, indent=1, sort_keys=True)
+        print()
+    if args.baseline:
+        with open(args.baseline) as f:
+            if not compare(results, json.load(f)):
+                exit(1)